@@ -2,7 +2,9 @@
 #define LINEARFRACTIONAL_H
 
 #include <iostream>
-#include <cassert>
+#include <array>
+#include <algorithm>
+#include <cmath>
 
 //Utility class for handling linear fractional operations
 
@@ -19,18 +21,37 @@ public:
         : a(_a), b(_b), c(_c), d(_d), valid(true) {}
 
 
-    // double eval(double x) {
+    // A zero denominator gives inf/nan, as a plain division would; callers
+    // that must reject division by zero check the divisors themselves.
     double eval(double x) const {
-        assert(c * x + d != 0);
         return (a * x + b) / (c * x + d);
     }
 
+    // d/dx of eval at x; a zero denominator gives inf/nan, as in eval
+    double derivative(double x) const {
+        double den = c * x + d;
+        return (a * d - b * c) / (den * den);
+    }
+
     LinearFractional compose(const LinearFractional& other) const {
         return LinearFractional(a * other.a + b * other.c,  a * other.b + b * other.d,
                                 c * other.a + d * other.c,  c * other.b + d * other.d);
     } 
 
+    // Same map with the largest coefficient scaled into [0.5, 1), so that long
+    // chains of compose() neither overflow nor underflow. The scale is a
+    // power of two, which keeps the rescaling itself exact.
+    LinearFractional normalized() const {
+        double m = std::max(std::max(std::fabs(a), std::fabs(b)), std::max(std::fabs(c), std::fabs(d)));
+        if (m == 0 || !std::isfinite(m)) return *this;
+        int e;
+        std::frexp(m, &e);
+        return LinearFractional(std::ldexp(a, -e), std::ldexp(b, -e), std::ldexp(c, -e), std::ldexp(d, -e));
+    }
+
     bool was_set() const { return valid; }
+
+    std::array<double, 4> coefficients() const { return {a, b, c, d}; }
 };
 
 
@@ -0,0 +1,22 @@
+#ifndef MAPNODE_H
+#define MAPNODE_H
+
+#include "Node.h"
+
+// Unary node applying a fixed linear fractional map to its only child.
+// Stands for a contracted subtree with one open child, e.g. a shard that
+// a worker process reduced to a LinearFractional.
+class MapNode : public Node {
+    LinearFractional rake_map(bool, double) const override { return lin_frac; }
+
+public:
+    MapNode(const LinearFractional& f, const Ptr& child) : Node(child, nullptr) { lin_frac = f; }
+    char op() const override { return 'm'; }
+
+    double compute() override {
+        value = lin_frac.eval(children()[0]->compute());
+        return *value;
+    }
+};
+
+#endif
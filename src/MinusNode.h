@@ -4,17 +4,14 @@
 #include "Node.h"
 
 class MinusNode : public Node {
-    void on_rake_left(double x) override {
-        if (lin_frac.was_set()) value = lin_frac.eval(x);
-        else lin_frac = LinearFractional(-1, x, 0, 1);
-    }
-    void on_rake_right(double x) override {
-        if (lin_frac.was_set()) value = lin_frac.eval(x);
-        else lin_frac = LinearFractional(1, -x, 0, 1);
+    LinearFractional rake_map(bool left_known, double x) const override {
+        return left_known ? LinearFractional(-1, x, 0, 1)   // x - y
+                          : LinearFractional(1, -x, 0, 1);  // y - x
     }
 
 public:
     MinusNode(const Ptr& l, const Ptr& r) : Node(l, r) {}
+    char op() const override { return '-'; }
 
     double compute() override {
         double first = children()[0]->compute();
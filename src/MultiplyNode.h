@@ -4,15 +4,13 @@
 #include "Node.h"
 
 class MultiplyNode : public Node {
-    void on_rake(double x){
-        if (lin_frac.was_set()) value = lin_frac.eval(x);
-        else lin_frac = LinearFractional(x, 0, 0, 1);
+    LinearFractional rake_map(bool, double x) const override {
+        return LinearFractional(x, 0, 0, 1);
     }
-    void on_rake_left(double x) override { on_rake(x); }
-    void on_rake_right(double x) override { on_rake(x); }
 
 public:
     MultiplyNode(const Ptr& l, const Ptr& r) : Node(l, r) {}
+    char op() const override { return '*'; }
 
     double compute() override {
         double prod = 1;
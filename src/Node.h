@@ -8,6 +8,7 @@
 #include <atomic>
 #include <optional>
 #include "LinearFractional.h"
+#include "Trace.h"
 
 class Node : public std::enable_shared_from_this<Node>
 {
@@ -23,18 +24,35 @@ private:
     std::mutex mutex;
     std::atomic<bool> done{false};
 
+    // Round bookkeeping for the expansion phase. A node that was raked into,
+    // compressed into or relinked during a round sits that round out, so
+    // whatever a node depends on when it is done is only done in a later round.
+    int done_round{-1};
+    int touched_round{-1};
+    bool compressed{false};
+
+    // For the gradient pass: how this node's value entered its parent when
+    // it was done. parent_map is the parent's map at that moment; after a
+    // first rake it is unset and the map is rebuilt from the sibling's value.
+    LinearFractional parent_map;
+    std::weak_ptr<Node> sibling;
+
 protected:
     bool is_left{false};
     LinearFractional lin_frac;
 
-    virtual void on_rake_left(double) = 0;
-    virtual void on_rake_right(double) = 0;
+    void on_rake(bool left_known, double x)
+    {
+        if (lin_frac.was_set()) value = lin_frac.eval(x);
+        else lin_frac = rake_map(left_known, x);
+    }
 
     // helpers for race‐free contraction
     bool readyToRake() const noexcept { return value.has_value(); }
 
 public:
     std::optional<double> value;
+    double adjoint{0.0}; // d root / d this, filled in by TreeBackprop
 
     Node() = default;
 
@@ -61,6 +79,8 @@ public:
     int degree() const { return num_children.load(); }
     bool isLeaf() const { return num_children.load() == 0; }
     bool isDone() const { return done.load(); }
+    bool wasCompressed() const { return compressed; }
+    int doneRound() const { return done_round; }
 
     std::vector<Ptr> children() const
     {
@@ -71,7 +91,7 @@ public:
         return v;
     }
 
-    void contract()
+    void contract(int round)
     {
         if (done.load()) return;
 
@@ -80,15 +100,19 @@ public:
             if(!p)
                 return;
             std::scoped_lock lk_par(mutex, p->mutex);
-            if(!(isParent(p) && num_children.load() == 0 && p->degree() >= 1 && !isDone())) return;
-            if (is_left) {
-                p->on_rake_left(*value);
-                p->left.reset();
-            } else {
-                p->on_rake_right(*value);
-                p->right.reset();
+            if(!(isParent(p) && num_children.load() == 0 && p->degree() >= 1 && !isDone())) {
+                TRACE_INSTANT("rake retry");
+                return;
             }
+            if (touched_round == round) return;
+            parent_map = p->lin_frac;
+            if (!parent_map.was_set()) sibling = is_left ? p->right : p->left;
+            p->on_rake(is_left, *value);
+            if (is_left) p->left.reset();
+            else p->right.reset();
             p->num_children.fetch_sub(1);
+            p->touched_round = round;
+            done_round = round;
             done.store(true);
         }
         else if (num_children.load() == 1 && !parent.expired() && parent.lock()->num_children.load() == 1) {
@@ -99,8 +123,13 @@ public:
             if(!son)
                 return;
             std::scoped_lock lk_other(mutex, p->mutex, son->mutex);
-            if(!(isParent(p) && isSon(son) && degree() == 1 && p->degree() == 1 && !isDone())) return;
-            p->lin_frac = p->lin_frac.compose(lin_frac);
+            if(!(isParent(p) && isSon(son) && degree() == 1 && p->degree() == 1 && !isDone())) {
+                TRACE_INSTANT("compress retry");
+                return;
+            }
+            if (touched_round == round) return;
+            parent_map = p->lin_frac;
+            p->lin_frac = p->lin_frac.compose(lin_frac).normalized();
             if (is_left) {
                 p->left = son;
                 son->is_left = true;
@@ -110,12 +139,44 @@ public:
             }
             son->parent = p;
             num_children.fetch_sub(1);
+            p->touched_round = round;
+            son->touched_round = round;
+            done_round = round;
+            compressed = true;
             done.store(true);
         }
     }
 
+    // Expansion phase: a compressed node still points at the child it was
+    // spliced over and its lin_frac is frozen, so its value follows as soon
+    // as that child's value is known (it was done in a later round).
+    void expand()
+    {
+        if (!compressed || value) return;
+        Ptr son = left ? left : right;
+        value = lin_frac.eval(*son->value);
+    }
+
+    // Reverse-mode pass, run after expansion: the parent this node was raked
+    // or compressed into was done in a later round, so its adjoint is final.
+    void backprop()
+    {
+        auto p = parent.lock();
+        if (!p || !done.load()) return;
+        LinearFractional m = parent_map;
+        if (!m.was_set()) m = p->rake_map(!is_left, *sibling.lock()->value);
+        adjoint = p->adjoint * m.derivative(*value);
+    }
+
     virtual double compute() = 0;
 
+    // map from the value of the remaining child to this node's value, once
+    // the child on the given side has been raked with value x
+    virtual LinearFractional rake_map(bool left_known, double x) const = 0;
+
+    // operator symbol, 'v' for a ValueNode (used to ship nodes between processes)
+    virtual char op() const = 0;
+
     bool isParent(const Ptr& potential_parent) const {
         return !parent.expired() && parent.lock() == potential_parent;
     }
@@ -0,0 +1,129 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "ValueNode.h"
+#include "PlusNode.h"
+#include "MinusNode.h"
+#include "MultiplyNode.h"
+#include "DivideNode.h"
+
+// Recursive-descent parser for infix expressions over + - * / with
+// parentheses and unary minus. Builds the Node tree (parents linked) and
+// collects every node, root first, in the form TreeContract expects.
+//
+//   expr   := term   (('+' | '-') term)*
+//   term   := factor (('*' | '/') factor)*
+//   factor := number | '(' expr ')' | '-' factor
+//
+// Parentheses and unary minus together may nest at most MAX_DEPTH deep, so
+// that neither the parser nor a recursive compute() can run off the stack.
+
+class ExpressionParser {
+public:
+    static constexpr int MAX_DEPTH = 1000;
+
+private:
+    const std::string& src;
+    std::size_t pos{0};
+    int depth{0};
+    std::vector<Node::Ptr>& nodes;
+
+    void skipSpaces() {
+        while (pos < src.size() && std::isspace(static_cast<unsigned char>(src[pos]))) ++pos;
+    }
+
+    [[noreturn]] void fail(const std::string& what) const {
+        throw std::runtime_error(what + " at position " + std::to_string(pos));
+    }
+
+    Node::Ptr add(Node::Ptr n) {
+        for (auto& c : n->children()) c->set_parent(n);
+        nodes.push_back(n);
+        return n;
+    }
+
+    Node::Ptr makeOp(char op, const Node::Ptr& l, const Node::Ptr& r) {
+        switch (op) {
+            case '+': return add(std::make_shared<PlusNode>(l, r));
+            case '-': return add(std::make_shared<MinusNode>(l, r));
+            case '*': return add(std::make_shared<MultiplyNode>(l, r));
+            default:  return add(std::make_shared<DivideNode>(l, r));
+        }
+    }
+
+    // consumes the '(' or unary '-' that opens one more nesting level
+    void enter() {
+        if (++depth > MAX_DEPTH) fail("nesting deeper than " + std::to_string(MAX_DEPTH));
+        ++pos;
+    }
+
+    Node::Ptr expr() {
+        Node::Ptr lhs = term();
+        for (skipSpaces(); pos < src.size() && (src[pos] == '+' || src[pos] == '-'); skipSpaces()) {
+            char op = src[pos++];
+            lhs = makeOp(op, lhs, term());
+        }
+        return lhs;
+    }
+
+    Node::Ptr term() {
+        Node::Ptr lhs = factor();
+        for (skipSpaces(); pos < src.size() && (src[pos] == '*' || src[pos] == '/'); skipSpaces()) {
+            char op = src[pos++];
+            lhs = makeOp(op, lhs, factor());
+        }
+        return lhs;
+    }
+
+    Node::Ptr factor() {
+        skipSpaces();
+        if (pos >= src.size()) fail("unexpected end of input");
+        if (src[pos] == '(') {
+            enter();
+            Node::Ptr inner = expr();
+            skipSpaces();
+            if (pos >= src.size() || src[pos] != ')') fail("expected ')'");
+            ++pos;
+            --depth;
+            return inner;
+        }
+        if (src[pos] == '-') {
+            enter();
+            auto zero = add(std::make_shared<ValueNode>(0.0));
+            Node::Ptr neg = makeOp('-', zero, factor());
+            --depth;
+            return neg;
+        }
+        const char* begin = src.c_str() + pos;
+        char* end = nullptr;
+        double v = std::strtod(begin, &end);
+        if (end == begin) fail("expected a number");
+        pos += static_cast<std::size_t>(end - begin);
+        return add(std::make_shared<ValueNode>(v));
+    }
+
+    ExpressionParser(const std::string& s, std::vector<Node::Ptr>& out) : src(s), nodes(out) {}
+
+public:
+    // Throws std::runtime_error on malformed input.
+    static Node::Ptr parse(const std::string& s, std::vector<Node::Ptr>& out_nodes)
+    {
+        out_nodes.clear();
+        if (s.find_first_not_of(" \t\n\r\f\v") == std::string::npos)
+            throw std::runtime_error("empty expression");
+        ExpressionParser p(s, out_nodes);
+        Node::Ptr root = p.expr();
+        p.skipSpaces();
+        if (p.pos != s.size()) p.fail("unexpected character");
+        // root first, as in the benchmark's collect_nodes
+        std::swap(out_nodes.front(), out_nodes.back());
+        return root;
+    }
+};
+
+#endif
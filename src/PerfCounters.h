@@ -0,0 +1,188 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Thin wrapper over Linux perf_event_open for the benchmark harness.
+// Every counter is opened on its own (no event group) so that a kernel
+// or VM lacking one event still reports the others; a counter that could
+// not be opened is simply marked as missing in the sample.
+
+namespace bench {
+
+enum PerfEvent { CYCLES, INSTRUCTIONS, LLC_MISSES, BRANCH_MISSES, CONTEXT_SWITCHES, NUM_PERF_EVENTS };
+
+inline const char* perf_event_name(int e)
+{
+    static const char* names[NUM_PERF_EVENTS] = {"cycles", "instructions", "llc_misses", "branch_misses", "ctx_switches"};
+    return names[e];
+}
+
+struct PerfSample {
+    std::array<double, NUM_PERF_EVENTS> val{};
+    std::array<bool, NUM_PERF_EVENTS> ok{};
+
+    bool has(PerfEvent e) const { return ok[e]; }
+    double get(PerfEvent e) const { return val[e]; }
+
+    PerfSample& operator+=(const PerfSample& o) {
+        for (int e = 0; e < NUM_PERF_EVENTS; ++e) {
+            if (!o.ok[e]) continue;
+            val[e] += o.val[e];
+            ok[e] = true;
+        }
+        return *this;
+    }
+
+    PerfSample& operator/=(double k) {
+        for (auto& v : val) v /= k;
+        return *this;
+    }
+};
+
+class PerfCounters {
+    std::array<int, NUM_PERF_EVENTS> fds;
+    std::array<int, NUM_PERF_EVENTS> open_errno{};
+
+    // Hardware events count user space only; software events such as
+    // context switches happen in the kernel and would always read 0 there.
+    int open_event(int e, pid_t tid, uint32_t type, uint64_t config)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = type == PERF_TYPE_HARDWARE;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0));
+        if (fd < 0) open_errno[e] = errno;
+        return fd;
+    }
+
+public:
+    // tid == 0 monitors the calling thread
+    explicit PerfCounters(pid_t tid = 0)
+    {
+        fds[CYCLES]           = open_event(CYCLES, tid, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        fds[INSTRUCTIONS]     = open_event(INSTRUCTIONS, tid, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fds[LLC_MISSES]       = open_event(LLC_MISSES, tid, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        fds[BRANCH_MISSES]    = open_event(BRANCH_MISSES, tid, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        fds[CONTEXT_SWITCHES] = open_event(CONTEXT_SWITCHES, tid, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters()
+    {
+        for (int fd : fds)
+            if (fd >= 0) close(fd);
+    }
+
+    bool available() const
+    {
+        for (int fd : fds)
+            if (fd >= 0) return true;
+        return false;
+    }
+
+    // "name: error" for every counter that could not be opened, or ""
+    std::string missing() const
+    {
+        std::string out;
+        for (int e = 0; e < NUM_PERF_EVENTS; ++e) {
+            if (fds[e] >= 0) continue;
+            if (!out.empty()) out += ", ";
+            out += std::string(perf_event_name(e)) + ": " + std::strerror(open_errno[e]);
+        }
+        return out;
+    }
+
+    void start()
+    {
+        for (int fd : fds) {
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    PerfSample stop()
+    {
+        PerfSample s;
+        for (int e = 0; e < NUM_PERF_EVENTS; ++e) {
+            if (fds[e] < 0) continue;
+            ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t buf[3] = {0, 0, 0}; // value, time enabled, time running
+            if (read(fds[e], buf, sizeof(buf)) != sizeof(buf)) continue;
+            // scale up if the kernel had to multiplex the counter
+            double v = static_cast<double>(buf[0]);
+            if (buf[2] > 0 && buf[2] < buf[1])
+                v *= static_cast<double>(buf[1]) / static_cast<double>(buf[2]);
+            s.val[e] = v;
+            s.ok[e] = true;
+        }
+        return s;
+    }
+};
+
+// One set of counters per thread, e.g. the main thread plus every pool worker.
+class PerfGroup {
+    std::vector<std::unique_ptr<PerfCounters>> counters;
+
+public:
+    explicit PerfGroup(const std::vector<pid_t>& tids)
+    {
+        for (pid_t tid : tids)
+            counters.push_back(std::make_unique<PerfCounters>(tid));
+    }
+
+    bool available() const
+    {
+        for (auto& c : counters)
+            if (c->available()) return true;
+        return false;
+    }
+
+    void start() { for (auto& c : counters) c->start(); }
+
+    std::vector<PerfSample> stop()
+    {
+        std::vector<PerfSample> per_thread;
+        per_thread.reserve(counters.size());
+        for (auto& c : counters) per_thread.push_back(c->stop());
+        return per_thread;
+    }
+
+    static PerfSample total(const std::vector<PerfSample>& per_thread)
+    {
+        PerfSample sum;
+        for (auto& s : per_thread) sum += s;
+        return sum;
+    }
+};
+
+inline pid_t current_tid() { return static_cast<pid_t>(syscall(SYS_gettid)); }
+
+// Probes every counter; returns an empty string if all of them open, else
+// which ones did not and why.
+inline std::string perf_unavailable_reason()
+{
+    return PerfCounters().missing();
+}
+
+}
+#endif
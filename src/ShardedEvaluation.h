@@ -0,0 +1,413 @@
+#ifndef SHARDEDEVALUATION_H
+#define SHARDEDEVALUATION_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Node.h"
+#include "ValueNode.h"
+#include "PlusNode.h"
+#include "MinusNode.h"
+#include "MultiplyNode.h"
+#include "DivideNode.h"
+#include "MapNode.h"
+#include "TreeContraction.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+
+// Multi-process evaluation of one large expression on a single Linux box.
+//
+// The tree is cut into shards, connected pieces with at most one open child
+// (the "hole"). Shards are packed into one POSIX shared-memory segment per
+// worker, which the coordinator maps before forking the worker processes.
+// Each worker reduces every shard either to a value or, if it has a hole, to
+// the LinearFractional taking the hole's value to the shard root's value
+// (composed with LinearFractional::compose). The coordinator then rebuilds
+// the skeleton, with reduced shards as ValueNodes / MapNodes, and contracts
+// it on the thread pool.
+//
+// A worker is forked from a multi-threaded process, so it must not allocate
+// or take a lock: it only reads and writes plain arrays in its segment,
+// scratch space included, and leaves with _exit().
+
+class ShardedEvaluation
+{
+    static constexpr int32_t NO_CHILD = -1;
+    static constexpr int32_t HOLE = -2;
+    static constexpr std::size_t MIN_SHARD = 1024;
+    static constexpr std::size_t SHARDS_PER_PROC = 4;
+
+    // shared-memory layout: Header | Entry[num_shards] | Record[...] | Slot[...]
+    struct Header { uint64_t num_shards; };
+    struct Entry {
+        uint64_t offset;      // byte offset of the shard's records
+        uint64_t slots;       // byte offset of its slots, one per record
+        uint64_t count;
+        int32_t has_hole;
+        int32_t div_by_zero;  // a '/' off the hole's path has a zero right operand
+        double result[4];     // value, or the map's coefficients a, b, c, d
+    };
+    // A shard's nodes in post-order (children first, root last); child
+    // indices are local to the shard.
+    struct Record { double value; int32_t left; int32_t right; char op; };
+    // Worker output per record; the coordinator reads the maps on the path
+    // to the hole back to check the divisors there.
+    struct Slot {
+        double val;
+        double map[4];     // a, b, c, d
+        int32_t on_path;   // on the way from the shard root to the hole
+    };
+
+    static Node::Ptr makeNode(char op, const Node::Ptr& l, const Node::Ptr& r)
+    {
+        switch (op) {
+            case '+': return std::make_shared<PlusNode>(l, r);
+            case '-': return std::make_shared<MinusNode>(l, r);
+            case '*': return std::make_shared<MultiplyNode>(l, r);
+            case '/': return std::make_shared<DivideNode>(l, r);
+        }
+        throw std::invalid_argument(std::string("sharded evaluation: unsupported node '") + op + "'");
+    }
+
+    // unmaps and unlinks the segments however the evaluation ends; holds
+    // only segments this evaluation created, never one another process owns
+    struct Segments {
+        std::vector<std::string> names;
+        std::vector<char*> base;
+        std::vector<std::size_t> size;
+        ~Segments()
+        {
+            for (std::size_t w = 0; w < names.size(); ++w) {
+                munmap(base[w], size[w]);
+                shm_unlink(names[w].c_str());
+            }
+        }
+    };
+
+    // Creates a segment that must not exist yet; it is unlinked again if it
+    // cannot be sized or mapped.
+    static char* createSegment(const std::string& name, std::size_t size)
+    {
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) throw std::runtime_error("shm_open " + name + ": " + std::strerror(errno));
+        if (ftruncate(fd, static_cast<off_t>(size)) < 0) {
+            int err = errno;
+            close(fd);
+            shm_unlink(name.c_str());
+            throw std::runtime_error("ftruncate " + name + ": " + std::strerror(err));
+        }
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int err = errno;
+        close(fd);
+        if (p == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            throw std::runtime_error("mmap " + name + ": " + std::strerror(err));
+        }
+        return static_cast<char*>(p);
+    }
+
+    // rake_map of each op, without a Node to call it on
+    static LinearFractional opMap(char op, bool left_known, double x)
+    {
+        switch (op) {
+            case '+': return LinearFractional(1, x, 0, 1);
+            case '-': return left_known ? LinearFractional(-1, x, 0, 1) : LinearFractional(1, -x, 0, 1);
+            case '*': return LinearFractional(x, 0, 0, 1);
+            default:  return left_known ? LinearFractional(0, x, 1, 0) : LinearFractional(1, 0, 0, x);
+        }
+    }
+
+    static double apply(char op, double l, double r)
+    {
+        switch (op) {
+            case '+': return l + r;
+            case '-': return l - r;
+            case '*': return l * r;
+            default:  return l / r;
+        }
+    }
+
+    static LinearFractional slotMap(const Slot* slot, int32_t c)
+    {
+        if (c == HOLE) return LinearFractional(1, 0, 0, 1);
+        const double* m = slot[c].map;
+        return LinearFractional(m[0], m[1], m[2], m[3]);
+    }
+
+    static void storeMap(Slot& s, const LinearFractional& f)
+    {
+        auto c = f.normalized().coefficients();
+        std::copy(c.begin(), c.end(), s.map);
+    }
+
+    static void reduceShard(const Record* rec, uint64_t count, Slot* slot, Entry& out)
+    {
+        for (uint64_t i = 0; i < count; ++i) {
+            const Record& r = rec[i];
+            Slot& s = slot[i];
+            s.on_path = 0;
+            if (r.op == 'v') { s.val = r.value; continue; }
+            bool lp = r.left == HOLE || slot[r.left].on_path;
+            bool rp = r.right == HOLE || slot[r.right].on_path;
+            if (r.op == '/' && !rp && slot[r.right].val == 0) out.div_by_zero = 1;
+            if (lp) {
+                storeMap(s, opMap(r.op, false, slot[r.right].val).compose(slotMap(slot, r.left)));
+                s.on_path = 1;
+            } else if (rp) {
+                storeMap(s, opMap(r.op, true, slot[r.left].val).compose(slotMap(slot, r.right)));
+                s.on_path = 1;
+            } else {
+                s.val = apply(r.op, slot[r.left].val, slot[r.right].val);
+            }
+        }
+
+        const Slot& root = slot[count - 1];
+        out.has_hole = root.on_path;
+        if (out.has_hole) std::copy(root.map, root.map + 4, out.result);
+        else out.result[0] = root.val;
+    }
+
+    // Worker process body, on the segment mapped before fork().
+    static int runWorker(char* base)
+    {
+        auto* h = reinterpret_cast<Header*>(base);
+        auto* entries = reinterpret_cast<Entry*>(h + 1);
+        for (uint64_t s = 0; s < h->num_shards; ++s)
+            reduceShard(reinterpret_cast<const Record*>(base + entries[s].offset), entries[s].count,
+                        reinterpret_cast<Slot*>(base + entries[s].slots), entries[s]);
+        return 0;
+    }
+
+public:
+    // Throws std::domain_error if any '/' has a zero right operand, as
+    // EvalService reports it for the other evaluation paths.
+    static double Evaluate(const Node::Ptr& root,
+                           int num_procs,
+                           int num_threads,
+                           SimplePool& pool)
+    {
+        // flatten in preorder: every node comes before its descendants
+        std::vector<Node*> node;
+        std::vector<int32_t> left, right, parent;
+        bool divisions = false;
+        {
+            TRACE_SCOPE("shard flatten");
+            std::vector<std::pair<Node*, int32_t>> st{{root.get(), NO_CHILD}};
+            while (!st.empty()) {
+                auto [v, par] = st.back();
+                st.pop_back();
+                int32_t i = static_cast<int32_t>(node.size());
+                node.push_back(v);
+                left.push_back(NO_CHILD);
+                right.push_back(NO_CHILD);
+                parent.push_back(par);
+                if (par != NO_CHILD) (left[par] == NO_CHILD ? left[par] : right[par]) = i;
+                auto ch = v->children();
+                divisions = divisions || v->op() == '/';
+                bool binary = std::strchr("+-*/", v->op()) != nullptr;
+                if (binary ? ch.size() != 2 : (v->op() != 'v' || !ch.empty()))
+                    throw std::invalid_argument("sharded evaluation needs a tree of ValueNodes and + - * / nodes");
+                if (!ch.empty()) {
+                    st.push_back({ch[1].get(), i});
+                    st.push_back({ch[0].get(), i});
+                }
+            }
+        }
+        std::size_t n = node.size();
+
+        // Partition bottom-up. A node stays pending (part of the shard being
+        // grown below it) until its piece is big enough to close as a shard,
+        // or until it would collect two holes: then it joins the skeleton and
+        // its pending children are closed as shards (small leaves stay in the
+        // skeleton). Every shard therefore has at most one hole.
+        std::size_t target = std::max(MIN_SHARD, n / (static_cast<std::size_t>(std::max(num_procs, 1)) * SHARDS_PER_PROC));
+        std::vector<std::size_t> pend(n);
+        std::vector<int32_t> holes(n);
+        std::vector<char> closed(n, 0), shard_root(n, 0), skeleton(n, 0);
+        {
+            TRACE_SCOPE("shard partition");
+            for (std::size_t k = n; k-- > 0;) {
+                pend[k] = 1;
+                holes[k] = 0;
+                for (int32_t c : {left[k], right[k]}) {
+                    if (c == NO_CHILD) continue;
+                    if (closed[c]) { ++holes[k]; continue; }
+                    pend[k] += pend[c];
+                    holes[k] += holes[c];
+                }
+                if (holes[k] >= 2) {
+                    skeleton[k] = closed[k] = 1;
+                    for (int32_t c : {left[k], right[k]}) {
+                        if (c == NO_CHILD || closed[c]) continue;
+                        closed[c] = 1;
+                        if (node[c]->op() == 'v') skeleton[c] = 1;
+                        else shard_root[c] = 1;
+                    }
+                } else if (pend[k] >= target) {
+                    shard_root[k] = closed[k] = 1;
+                }
+            }
+            if (!closed[0]) shard_root[0] = closed[0] = 1;
+        }
+
+        // shard ids top-down, then each shard's records bottom-up
+        std::vector<int32_t> shard_of(n, NO_CHILD), local(n, 0), hole_of;
+        std::vector<std::vector<Record>> shards;
+        for (std::size_t k = 0; k < n; ++k) {
+            if (shard_root[k]) {
+                shard_of[k] = static_cast<int32_t>(shards.size());
+                shards.emplace_back();
+                hole_of.push_back(NO_CHILD);
+            } else if (!skeleton[k]) {
+                shard_of[k] = shard_of[parent[k]];
+            }
+        }
+        for (std::size_t k = n; k-- > 0;) {
+            int32_t s = shard_of[k];
+            if (s == NO_CHILD) continue;
+            auto childRef = [&](int32_t c) -> int32_t {
+                if (c == NO_CHILD) return NO_CHILD;
+                if (closed[c]) { hole_of[s] = c; return HOLE; }
+                return local[c];
+            };
+            local[k] = static_cast<int32_t>(shards[s].size());
+            shards[s].push_back({node[k]->op() == 'v' ? *node[k]->value : 0.0,
+                                 childRef(left[k]), childRef(right[k]), node[k]->op()});
+        }
+
+        // longest shard first onto the least loaded worker
+        std::size_t workers = std::min<std::size_t>(std::max(num_procs, 1), shards.size());
+        std::vector<std::vector<int32_t>> assigned(workers);
+        {
+            std::vector<int32_t> order(shards.size());
+            for (std::size_t s = 0; s < order.size(); ++s) order[s] = static_cast<int32_t>(s);
+            std::sort(order.begin(), order.end(),
+                      [&](int32_t a, int32_t b) { return shards[a].size() > shards[b].size(); });
+            std::vector<std::size_t> load(workers, 0);
+            for (int32_t s : order) {
+                std::size_t w = std::min_element(load.begin(), load.end()) - load.begin();
+                assigned[w].push_back(s);
+                load[w] += shards[s].size();
+            }
+        }
+
+        Segments segs;
+        for (std::size_t w = 0; w < workers; ++w) {
+            TRACE_SCOPE("shard ship", static_cast<int64_t>(w));
+            std::size_t records = 0;
+            for (int32_t s : assigned[w]) records += shards[s].size();
+            std::size_t table = sizeof(Header) + assigned[w].size() * sizeof(Entry);
+            std::size_t slots = table + records * sizeof(Record);
+            slots = (slots + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+            std::size_t size = slots + records * sizeof(Slot);
+            std::string name = "/cse305-expr-" + std::to_string(getpid()) + "-" + std::to_string(w);
+            char* base = createSegment(name, size);
+            segs.names.push_back(name);
+            segs.base.push_back(base);
+            segs.size.push_back(size);
+            reinterpret_cast<Header*>(base)->num_shards = assigned[w].size();
+            auto* entries = reinterpret_cast<Entry*>(base + sizeof(Header));
+            std::size_t off = table;
+            for (std::size_t j = 0; j < assigned[w].size(); ++j) {
+                const auto& recs = shards[assigned[w][j]];
+                entries[j] = Entry{off, slots, recs.size(), 0, 0, {0, 0, 0, 0}};
+                std::memcpy(base + off, recs.data(), recs.size() * sizeof(Record));
+                off += recs.size() * sizeof(Record);
+                slots += recs.size() * sizeof(Slot);
+            }
+        }
+
+        {
+            TRACE_SCOPE("shard workers");
+            std::vector<pid_t> pids;
+            for (std::size_t w = 0; w < workers; ++w) {
+                pid_t pid = fork();
+                if (pid == 0) _exit(runWorker(segs.base[w]));
+                if (pid < 0) {
+                    for (pid_t p : pids) waitpid(p, nullptr, 0);
+                    throw std::runtime_error(std::string("fork: ") + std::strerror(errno));
+                }
+                pids.push_back(pid);
+            }
+            bool ok = true;
+            for (pid_t p : pids) {
+                int status = 0;
+                if (waitpid(p, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+            }
+            if (!ok) throw std::runtime_error("sharded evaluation: a worker process failed");
+        }
+
+        std::vector<Entry> result(shards.size());
+        std::vector<const Slot*> slots_of(shards.size());
+        for (std::size_t w = 0; w < workers; ++w) {
+            auto* entries = reinterpret_cast<Entry*>(segs.base[w] + sizeof(Header));
+            for (std::size_t j = 0; j < assigned[w].size(); ++j) {
+                result[assigned[w][j]] = entries[j];
+                slots_of[assigned[w][j]] = reinterpret_cast<const Slot*>(segs.base[w] + entries[j].slots);
+            }
+        }
+        for (const Entry& e : result)
+            if (e.div_by_zero) throw std::domain_error("division by zero");
+
+        // skeleton: every closed node, rebuilt bottom-up with the shard results
+        std::vector<Node::Ptr> skel(n);
+        std::vector<Node::Ptr> nodes;
+        for (std::size_t k = n; k-- > 0;) {
+            if (!closed[k]) continue;
+            Node::Ptr v;
+            if (shard_root[k]) {
+                const Entry& e = result[shard_of[k]];
+                if (e.has_hole) {
+                    LinearFractional f(e.result[0], e.result[1], e.result[2], e.result[3]);
+                    v = std::make_shared<MapNode>(f, skel[hole_of[shard_of[k]]]);
+                } else {
+                    v = std::make_shared<ValueNode>(e.result[0]);
+                }
+            } else if (node[k]->op() == 'v') {
+                v = std::make_shared<ValueNode>(*node[k]->value);
+            } else {
+                v = makeNode(node[k]->op(), skel[left[k]], skel[right[k]]);
+            }
+            for (auto& c : v->children()) c->set_parent(v);
+            nodes.push_back(v);
+            skel[k] = v;
+        }
+
+        TRACE_SCOPE("skeleton contract", static_cast<int64_t>(nodes.size()));
+        std::swap(nodes.front(), nodes.back()); // root first
+        int rounds = TreeContraction::TreeContract(nodes, skel[0], num_threads, pool);
+        pool.waitIdle();
+        if (divisions) {
+            // the remaining divisors: the skeleton's own, and those on a
+            // shard's path to its hole, which follow from the hole's value
+            TreeContraction::TreeExpand(nodes, rounds, num_threads, pool);
+            pool.waitIdle();
+            for (std::size_t k = 0; k < n; ++k)
+                if (skeleton[k] && node[k]->op() == '/' && *skel[right[k]]->value == 0)
+                    throw std::domain_error("division by zero");
+            for (std::size_t sh = 0; sh < shards.size(); ++sh) {
+                if (!result[sh].has_hole) continue;
+                double h = *skel[hole_of[sh]]->value;
+                const Slot* slot = slots_of[sh];
+                for (const Record& r : shards[sh]) {
+                    if (r.op != '/' || !(r.right == HOLE || slot[r.right].on_path)) continue;
+                    double x = r.right == HOLE ? h : slotMap(slot, r.right).eval(h);
+                    if (x == 0) throw std::domain_error("division by zero");
+                }
+            }
+        }
+        return *skel[0]->value;
+    }
+};
+
+#endif
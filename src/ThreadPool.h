@@ -9,6 +9,8 @@
 #include <functional>
 #include <atomic>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include "Trace.h"
 
 template<class E>
 class SafeUnboundedQueue {
@@ -27,9 +29,12 @@ class SafeUnboundedQueue {
 
         E pop() {
             std::unique_lock<std::mutex> lk(lock);
-            while (elements.empty()) {
-                empty.notify_all();
-                not_empty.wait(lk);
+            if (elements.empty()) {
+                TRACE_SCOPE("idle");
+                while (elements.empty()) {
+                    empty.notify_all();
+                    not_empty.wait(lk);
+                }
             }
             E e = std::move(elements.front());
             elements.pop();
@@ -53,13 +58,26 @@ class SimplePool {
         std::atomic<std::size_t> active{0};
         std::mutex idle_mtx;
         std::condition_variable idle_cv;
+
+        // kernel thread ids of the workers (for per-thread perf counters)
+        std::vector<pid_t> tids;
+        std::mutex tids_mtx;
+        std::condition_variable tids_cv;
         
         void do_work() {
+            {
+                std::lock_guard<std::mutex> lk(tids_mtx);
+                tids.push_back(static_cast<pid_t>(syscall(SYS_gettid)));
+            }
+            tids_cv.notify_all();
             bool cont = true;
             while (cont) {
                 auto task = tasks.pop();
                 active.fetch_add(1);
-                cont = task();
+                {
+                    TRACE_SCOPE("task");
+                    cont = task();
+                }
                 if (active.fetch_sub(1) == 1) {
                     std::lock_guard<std::mutex> lk(idle_mtx);
                     idle_cv.notify_all();
@@ -84,6 +102,13 @@ class SimplePool {
 
         void waitEmpty() { tasks.waitEmpty(); }
 
+        // blocks until every worker has started
+        std::vector<pid_t> thread_ids() {
+            std::unique_lock<std::mutex> lk(tids_mtx);
+            tids_cv.wait(lk, [this] { return tids.size() == num_workers; });
+            return tids;
+        }
+
         // queue empty and no active tasks
         void waitIdle() {
             std::unique_lock<std::mutex> lk(idle_mtx);
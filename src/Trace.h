@@ -0,0 +1,148 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Optional timeline tracing, enabled with -DEXPR_TRACE (make TRACE=1).
+// Each thread appends to its own fixed-size ring buffer, so recording takes
+// no lock; when the ring is full the oldest events are overwritten. dump()
+// writes Chrome Trace Event JSON, which loads in Perfetto / chrome://tracing.
+// Without EXPR_TRACE every TRACE_* macro expands to nothing.
+
+#ifdef EXPR_TRACE
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace trace {
+
+struct Event {
+    const char* name;
+    char ph;          // 'X' complete span, 'i' instant
+    int64_t ts_ns;
+    int64_t dur_ns;
+    int64_t arg;      // < 0: no argument
+};
+
+inline int64_t now_ns()
+{
+    static const auto epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - epoch).count();
+}
+
+class Ring {
+public:
+    static constexpr std::size_t CAPACITY = 1 << 16;
+
+    explicit Ring(pid_t t) : tid(t), events(CAPACITY) {}
+
+    void push(const Event& e) { events[count++ % CAPACITY] = e; }
+
+    pid_t tid;
+    std::vector<Event> events;
+    uint64_t count{0};
+};
+
+class Registry {
+    std::mutex mtx;
+    std::vector<std::unique_ptr<Ring>> rings; // outlive their threads
+
+public:
+    static Registry& get()
+    {
+        static Registry r;
+        return r;
+    }
+
+    Ring* add()
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        rings.push_back(std::make_unique<Ring>(static_cast<pid_t>(syscall(SYS_gettid))));
+        return rings.back().get();
+    }
+
+    // Call while the traced threads are quiescent (e.g. pool idle).
+    bool dump(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        std::ofstream out(path);
+        if (!out) return false;
+        out << std::fixed << std::setprecision(3); // ts/dur in us, to the ns
+        out << "{\"traceEvents\":[\n";
+        bool first = true;
+        for (auto& r : rings) {
+            uint64_t n = std::min<uint64_t>(r->count, Ring::CAPACITY);
+            for (uint64_t i = r->count - n; i < r->count; ++i) {
+                const Event& e = r->events[i % Ring::CAPACITY];
+                if (!first) out << ",\n";
+                first = false;
+                out << "{\"name\":\"" << e.name << "\",\"ph\":\"" << e.ph
+                    << "\",\"pid\":" << getpid() << ",\"tid\":" << r->tid
+                    << ",\"ts\":" << e.ts_ns / 1000.0;
+                if (e.ph == 'X') out << ",\"dur\":" << e.dur_ns / 1000.0;
+                else out << ",\"s\":\"t\"";
+                if (e.arg >= 0) out << ",\"args\":{\"v\":" << e.arg << '}';
+                out << '}';
+            }
+        }
+        out << "\n]}\n";
+        return static_cast<bool>(out);
+    }
+};
+
+inline Ring& local()
+{
+    thread_local Ring* ring = Registry::get().add();
+    return *ring;
+}
+
+inline void instant(const char* name, int64_t arg = -1)
+{
+    local().push({name, 'i', now_ns(), 0, arg});
+}
+
+class Scope {
+    const char* name;
+    int64_t arg;
+    int64_t start;
+
+public:
+    explicit Scope(const char* n, int64_t a = -1) : name(n), arg(a), start(now_ns()) {}
+    ~Scope() { local().push({name, 'X', start, now_ns() - start, arg}); }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+};
+
+// Writes the trace to $EXPR_TRACE_FILE, or trace.json.
+inline bool dump_default()
+{
+    const char* path = std::getenv("EXPR_TRACE_FILE");
+    return Registry::get().dump(path ? path : "trace.json");
+}
+
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(...) trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+#define TRACE_INSTANT(...) trace::instant(__VA_ARGS__)
+#define TRACE_DUMP() trace::dump_default()
+
+#else
+
+#define TRACE_SCOPE(...) ((void)0)
+#define TRACE_INSTANT(...) ((void)0)
+#define TRACE_DUMP() ((void)0)
+
+#endif
+
+#endif
@@ -3,41 +3,156 @@
 
 #include "Node.h"
 #include "ThreadPool.h"
+#include "Trace.h"
 #include <vector>
 #include <latch>
 
 class TreeContraction
 {
 public:
-    static void schedule_contract(const std::vector<Node::Ptr>& nodes, std::size_t st, std::size_t en, std::latch& ltch)
+    static void schedule_contract(const std::vector<Node::Ptr>& nodes, std::size_t st, std::size_t en, int round, std::latch& ltch)
     {
         for (std::size_t i = st; i < en; ++i){
             if (nodes[i] && !nodes[i]->isDone())
-                nodes[i]->contract();
+                nodes[i]->contract(round);
             ltch.count_down();
         }
     }
 
-    static void TreeContract(const std::vector<Node::Ptr>& nodes,
+    // Returns the number of rounds, which TreeExpand replays.
+    static int TreeContract(const std::vector<Node::Ptr>& nodes,
                                     const Node::Ptr& root,
                                     int num_threads,
                                     SimplePool& pool)
     {
         int n = static_cast<int>(nodes.size());
         int stride = n / num_threads + 1;
+        int round = 0;
 
         while (root->degree() > 0) {
+            TRACE_SCOPE("contract round", round);
             std::latch ltch(n);
             for (int i = 0; i < n; i += stride)
                 pool.push(schedule_contract,
                           std::cref(nodes),
                           static_cast<std::size_t>(i),
                           static_cast<std::size_t>(std::min(i + stride, n)),
+                          round,
+                          std::ref(ltch));
+            {
+                TRACE_SCOPE("latch wait", round);
+                ltch.wait();
+            }
+            ++round;
+        }
+        return round;
+    }
+
+    using Buckets = std::vector<std::vector<std::vector<Node*>>>; // [chunk][round]
+
+    // buckets[r] = nodes of this chunk that were done in round r
+    static void schedule_bucket(const std::vector<Node::Ptr>& nodes, std::size_t st, std::size_t en,
+                                bool compressed_only, std::vector<std::vector<Node*>>& buckets, std::latch& ltch)
+    {
+        for (std::size_t i = st; i < en; ++i) {
+            if (!nodes[i] || !nodes[i]->isDone()) continue;
+            if (compressed_only && !nodes[i]->wasCompressed()) continue;
+            buckets[nodes[i]->doneRound()].push_back(nodes[i].get());
+        }
+        ltch.count_down();
+    }
+
+    static void schedule_step(const std::vector<Node*>& bucket, void (Node::*step)(), std::latch& ltch)
+    {
+        for (Node* v : bucket) (v->*step)();
+        ltch.count_down();
+    }
+
+    // Buckets each chunk of nodes by round once (keeping the total work O(n))
+    // and then runs step on every bucketed node, latest round first.
+    static void ReplayRounds(const std::vector<Node::Ptr>& nodes,
+                                    int rounds,
+                                    bool compressed_only,
+                                    void (Node::*step)(),
+                                    int num_threads,
+                                    SimplePool& pool)
+    {
+        int n = static_cast<int>(nodes.size());
+        int stride = n / num_threads + 1;
+        int chunks = (n + stride - 1) / stride;
+        Buckets buckets(chunks, std::vector<std::vector<Node*>>(rounds));
+
+        {
+            std::latch ltch(chunks);
+            for (int c = 0; c < chunks; ++c)
+                pool.push(schedule_bucket,
+                          std::cref(nodes),
+                          static_cast<std::size_t>(c * stride),
+                          static_cast<std::size_t>(std::min((c + 1) * stride, n)),
+                          compressed_only,
+                          std::ref(buckets[c]),
                           std::ref(ltch));
             ltch.wait();
         }
+
+        for (int r = rounds - 1; r >= 0; --r) {
+            int busy = 0;
+            for (int c = 0; c < chunks; ++c) busy += !buckets[c][r].empty();
+            if (busy == 0) continue;
+            TRACE_SCOPE("replay round", r);
+            std::latch ltch(busy);
+            for (int c = 0; c < chunks; ++c)
+                if (!buckets[c][r].empty())
+                    pool.push(schedule_step, std::cref(buckets[c][r]), step, std::ref(ltch));
+            ltch.wait();
+        }
+    }
+
+    // Expansion (uncontraction) phase: replays the rounds of TreeContract in
+    // reverse and fills in the value of every node that was compressed away,
+    // so that after it every node of the tree holds its value.
+    static void TreeExpand(const std::vector<Node::Ptr>& nodes,
+                                  int rounds,
+                                  int num_threads,
+                                  SimplePool& pool)
+    {
+        ReplayRounds(nodes, rounds, true, &Node::expand, num_threads, pool);
+    }
+
+    // Reverse-mode differentiation, after TreeExpand: sets node->adjoint to
+    // d root / d node for every node, propagating top-down through the maps
+    // each node was raked or compressed with.
+    static void TreeBackprop(const std::vector<Node::Ptr>& nodes,
+                                    const Node::Ptr& root,
+                                    int rounds,
+                                    int num_threads,
+                                    SimplePool& pool)
+    {
+        root->adjoint = 1.0;
+        ReplayRounds(nodes, rounds, false, &Node::backprop, num_threads, pool);
+    }
+
+    struct Gradient {
+        double value;
+        std::vector<double> grad; // grad[i] = d root / d nodes[i]
+    };
+
+    // Contraction, expansion and backpropagation in one call. For the
+    // ValueNodes in nodes, grad holds the gradient of the root w.r.t. the leaves.
+    static Gradient TreeGradient(const std::vector<Node::Ptr>& nodes,
+                                 const Node::Ptr& root,
+                                 int num_threads,
+                                 SimplePool& pool)
+    {
+        int rounds = TreeContract(nodes, root, num_threads, pool);
+        TreeExpand(nodes, rounds, num_threads, pool);
+        TreeBackprop(nodes, root, rounds, num_threads, pool);
+        pool.waitIdle();
+        Gradient g{*root->value, std::vector<double>(nodes.size(), 0.0)};
+        for (std::size_t i = 0; i < nodes.size(); ++i)
+            if (nodes[i]) g.grad[i] = nodes[i]->adjoint;
+        return g;
     }
 };
 
 #endif
-
@@ -4,11 +4,11 @@
 #include "Node.h"
 
 class ValueNode : public Node {
-    void on_rake_left(double) override {}
-    void on_rake_right(double) override {}
+    LinearFractional rake_map(bool, double) const override { return LinearFractional(); }
 
 public:
     explicit ValueNode(double v) : Node() { value = v; }
+    char op() const override { return 'v'; }
     double compute() override { return *value; }
 };
 
@@ -5,6 +5,7 @@
 #include <vector>
 #include <string>
 #include <cmath>
+#include <cfloat>
 #include <cassert>
 #include <thread>
 
@@ -15,9 +16,13 @@
 #include "DivideNode.h"
 #include "BuildTrees.h"
 #include "TreeContraction.h"
+#include "ShardedEvaluation.h"
 #include "ThreadPool.h"
+#include "PerfCounters.h"
 
 const int MAX_NODES = 4'000'000;
+const std::size_t GRAD_CHECK_MAX_NODES = 1 << 10; // every leaf costs two sequential passes: O(n^2)
+const int SHARD_CHECK_PROCS = 3;
 
 static std::size_t countNodes(const Node::Ptr& root) {
     if (!root) return 0;
@@ -35,13 +40,14 @@ static void collect_nodes(const Node::Ptr& n, std::vector<Node::Ptr>& v) {
 static double runTreeContraction(const Node::Ptr& root,
                                  unsigned threads,
                                  SimplePool& pool,
+                                 int& rounds,
                                  unsigned long seed = 0) {
     std::vector<Node::Ptr> nodes;
     collect_nodes(root, nodes);
     std::mt19937 rng(seed ? seed : 0x9e3779b97f4a7c15ULL);
     if (nodes.size() > 1)
         std::shuffle(nodes.begin() + 1, nodes.end(), rng);
-    TreeContraction::TreeContract(nodes, root, threads, pool);
+    rounds = TreeContraction::TreeContract(nodes, root, threads, pool);
     pool.waitIdle();
     return root->value ? *root->value : root->compute();
 }
@@ -56,6 +62,42 @@ double time_us(F&& f) {
 
 static inline bool isFinite(double x) { return std::isfinite(x); }
 
+static const char* DERIVED_COLUMNS[] = {"ipc", "llc_miss_per_node", "branch_miss_per_node"};
+
+static void printPerfHeader(const std::string& phase) {
+    for (int e = 0; e < bench::NUM_PERF_EVENTS; ++e) std::cout << ',' << phase << '_' << bench::perf_event_name(e);
+    for (const char* c : DERIVED_COLUMNS) std::cout << ',' << phase << '_' << c;
+}
+
+// raw counters followed by derived metrics; missing counters leave empty fields
+static void printPerf(const bench::PerfSample& s, std::size_t n_nodes) {
+    using namespace bench;
+    for (int e = 0; e < NUM_PERF_EVENTS; ++e) {
+        std::cout << ',';
+        if (s.ok[e]) std::cout << s.val[e];
+    }
+    std::cout << ',';
+    if (s.has(CYCLES) && s.has(INSTRUCTIONS) && s.get(CYCLES) > 0)
+        std::cout << s.get(INSTRUCTIONS) / s.get(CYCLES);
+    std::cout << ',';
+    if (s.has(LLC_MISSES)) std::cout << s.get(LLC_MISSES) / n_nodes;
+    std::cout << ',';
+    if (s.has(BRANCH_MISSES)) std::cout << s.get(BRANCH_MISSES) / n_nodes;
+}
+
+// per-thread cycles of the contraction phase, main thread first, ';'-separated;
+// a thread without a cycle count keeps an empty slot so positions match threads
+static void printThreadCycles(const std::vector<bench::PerfSample>& per_thread) {
+    std::cout << ',';
+    bool any = false;
+    for (auto& s : per_thread) any = any || s.has(bench::CYCLES);
+    if (!any) return;
+    for (std::size_t i = 0; i < per_thread.size(); ++i) {
+        if (i) std::cout << ';';
+        if (per_thread[i].has(bench::CYCLES)) std::cout << per_thread[i].get(bench::CYCLES);
+    }
+}
+
 int main(int argc, char* argv[])
 {
     const int REPS = (argc > 1) ? std::stoi(argv[1]) : 1;
@@ -69,7 +111,13 @@ int main(int argc, char* argv[])
     if (threadCounts.back() != HW_THREADS) threadCounts.push_back(HW_THREADS);
 
     std::mt19937 master(42);
-    std::cout << "tree_type,depth,threads,n_nodes,baseline_us,contraction_us,speedup\n";
+    std::string perfReason = bench::perf_unavailable_reason();
+    if (!perfReason.empty())
+        std::cerr << "perf counters unavailable (" << perfReason << "), their columns left empty\n";
+
+    std::cout << "tree_type,depth,threads,n_nodes,baseline_us,contraction_us,speedup,expansion_us,backprop_us";
+    for (const char* phase : {"build", "base", "contr"}) printPerfHeader(phase);
+    std::cout << ",contr_thread_cycles\n";
     std::cout << std::fixed << std::setprecision(3);
 
     using TreeGen = std::function<Node::Ptr(unsigned, std::mt19937&)>;
@@ -86,6 +134,10 @@ int main(int argc, char* argv[])
 
     for (unsigned t : threadCounts) {
         SimplePool pool(t);
+        std::vector<pid_t> tids{bench::current_tid()};
+        for (pid_t w : pool.thread_ids()) tids.push_back(w);
+        bench::PerfCounters mainPerf;
+        bench::PerfGroup contrPerf(tids);
         for (const auto& [name, makeTree] : treeGenerators) {
             for (unsigned d = 1; d <= 20; ++d) {
                 unsigned long seed = master();
@@ -94,36 +146,116 @@ int main(int argc, char* argv[])
                 std::size_t n_nodes = countNodes(sample);
                 if (n_nodes > MAX_NODES) continue;
 
+                bench::PerfSample build_ps, base_ps, contr_ps;
+                std::vector<bench::PerfSample> contr_threads(tids.size());
+
                 std::vector<double> baselineVals(REPS);
+                std::vector<std::vector<double>> baselineNodeVals(REPS); // preorder
                 double base_sum = 0.0;
                 for (int i = 0; i < REPS; ++i) {
                     std::mt19937 gi(seed + i);
+                    mainPerf.start();
                     Node::Ptr tmp = makeTree(d, gi);
+                    build_ps += mainPerf.stop();
                     double val = 0.0;
+                    mainPerf.start();
                     base_sum += time_us([&] { val = tmp->compute(); });
+                    base_ps += mainPerf.stop();
                     baselineVals[i] = val;
+                    std::vector<Node::Ptr> order;
+                    collect_nodes(tmp, order);
+                    for (auto& v : order) baselineNodeVals[i].push_back(*v->value);
                 }
                 double base_us = base_sum / REPS;
 
                 constexpr double ABS_REL_SWITCH = 1.0;
                 constexpr double ABS_EPS = 1e-12;
 
+                auto closeEnough = [&](double ref, double val) {
+                    double absTol = tolFactor * std::pow(static_cast<double>(n_nodes), tolExp);
+                    double relTol = tolFactor * std::fabs(ref);
+                    double tol = (std::fabs(ref) < ABS_REL_SWITCH) ? std::max(absTol, ABS_EPS) : relTol;
+                    return !isFinite(ref) || std::fabs(ref - val) <= tol; // an inf/nan val fails
+                };
+
                 double contr_sum = 0.0;
+                double expand_sum = 0.0;
+                double backprop_sum = 0.0;
                 for (int i = 0; i < REPS; ++i) {
                     std::mt19937 gi(seed + i);
                     Node::Ptr tmp = makeTree(d, gi);
+                    std::vector<Node::Ptr> order; // contraction unlinks children, keep the preorder
+                    collect_nodes(tmp, order);
                     double val = 0.0;
-                    contr_sum += time_us([&] { val = runTreeContraction(tmp, t, pool); });
-                    double ref = baselineVals[i];
-                    double absTol = tolFactor * std::pow(static_cast<double>(n_nodes), tolExp);
-                    double relTol = tolFactor * std::fabs(ref);
-                    double tol = (std::fabs(ref) < ABS_REL_SWITCH) ? std::max(absTol, ABS_EPS) : relTol;
-                    if (isFinite(ref) && isFinite(val)) {
-                        assert(std::fabs(ref - val) <= tol);
+                    int rounds = 0;
+                    contrPerf.start();
+                    contr_sum += time_us([&] { val = runTreeContraction(tmp, t, pool, rounds); });
+                    auto per_thread = contrPerf.stop();
+                    for (std::size_t k = 0; k < per_thread.size(); ++k) contr_threads[k] += per_thread[k];
+                    assert(closeEnough(baselineVals[i], val));
+
+                    expand_sum += time_us([&] {
+                        TreeContraction::TreeExpand(order, rounds, t, pool);
+                        pool.waitIdle();
+                    });
+                    for (std::size_t k = 0; k < order.size(); ++k) {
+                        assert(order[k]->value);
+                        assert(closeEnough(baselineNodeVals[i][k], *order[k]->value));
+                    }
+
+                    // ShardedEvaluation on another copy, as eval --procs runs it
+                    {
+                        std::mt19937 gs(seed + i);
+                        Node::Ptr shardTree = makeTree(d, gs);
+                        assert(closeEnough(baselineVals[i], ShardedEvaluation::Evaluate(shardTree, SHARD_CHECK_PROCS, t, pool)));
+                    }
+
+                    backprop_sum += time_us([&] {
+                        TreeContraction::TreeBackprop(order, tmp, rounds, t, pool);
+                        pool.waitIdle();
+                    });
+                    // small trees: TreeGradient on a fresh copy must agree with the
+                    // timed backprop, and with central finite differences at every leaf
+                    if (n_nodes <= GRAD_CHECK_MAX_NODES) {
+                        std::mt19937 gg(seed + i);
+                        Node::Ptr gradTree = makeTree(d, gg);
+                        std::vector<Node::Ptr> gOrder;
+                        collect_nodes(gradTree, gOrder);
+                        TreeContraction::Gradient grad = TreeContraction::TreeGradient(gOrder, gradTree, t, pool);
+                        assert(closeEnough(baselineVals[i], grad.value));
+
+                        std::mt19937 gf(seed + i);
+                        Node::Ptr fresh = makeTree(d, gf);
+                        std::vector<Node::Ptr> fOrder;
+                        collect_nodes(fresh, fOrder);
+                        double f0 = baselineVals[i];
+                        for (std::size_t k = 0; k < fOrder.size(); ++k) {
+                            double g = grad.grad[k];
+                            assert(!isFinite(g) || std::fabs(g - order[k]->adjoint) <= 1e-9 * std::fabs(g));
+                            if (!fOrder[k]->isLeaf()) continue;
+                            double v = *fOrder[k]->value;
+                            double h = 1e-6 * std::max(1.0, std::fabs(v));
+                            fOrder[k]->value = v + h;
+                            double fp = fresh->compute();
+                            fOrder[k]->value = v - h;
+                            double fm = fresh->compute();
+                            fOrder[k]->value = v;
+                            double fd = (fp - fm) / (2 * h);
+                            // relative to the gradient itself, plus what the quotient can resolve
+                            double roundoff = 64 * DBL_EPSILON * std::fabs(f0) / h;
+                            if (isFinite(fd) && isFinite(g))
+                                assert(std::fabs(fd - g) <= 1e-5 * std::fabs(g) + roundoff);
+                        }
                     }
                 }
                 double contr_us = contr_sum / REPS;
+                double expand_us = expand_sum / REPS;
+                double backprop_us = backprop_sum / REPS;
                 double speedup = base_us / contr_us;
+                build_ps /= REPS;
+                base_ps /= REPS;
+                for (auto& ps : contr_threads) ps /= REPS;
+                contr_ps = bench::PerfGroup::total(contr_threads);
 
                 std::cout << name << ','
                           << d << ','
@@ -131,11 +263,19 @@ int main(int argc, char* argv[])
                           << n_nodes << ','
                           << base_us << ','
                           << contr_us << ','
-                          << speedup << '\n';
+                          << speedup << ','
+                          << expand_us << ','
+                          << backprop_us;
+                printPerf(build_ps, n_nodes);
+                printPerf(base_ps, n_nodes);
+                printPerf(contr_ps, n_nodes);
+                printThreadCycles(contr_threads);
+                std::cout << '\n';
             }
         }
         pool.stop();
     }
+    TRACE_DUMP();
     return 0;
 }
 
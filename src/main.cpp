@@ -1,10 +1,345 @@
 #include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <latch>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #include "Node.h"
-#include "ValueNode.h"
-#include "PlusNode.h"
-#include "MultiplyNode.h"
-#include "DivideNode.h"
+#include "Parser.h"
+#include "TreeContraction.h"
+#include "ShardedEvaluation.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+
+// Expression evaluation service: reads one expression per line from stdin,
+// a file or a local Unix socket, evaluates them in batches on a persistent
+// pool and writes one result per line back, in request order.
+//
+//   eval [--input FILE | --socket PATH] [--threads N] [--batch N] [--threshold N]
+//        [--procs N] [--shard-threshold N]
+//
+// Expressions with fewer than --threshold nodes are evaluated sequentially
+// inside a pool task; larger ones go through TreeContraction on the same pool.
+// With --procs > 1, expressions of at least --shard-threshold nodes are split
+// over that many worker processes (ShardedEvaluation).
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string input;
+    std::string socket_path;
+    unsigned threads = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+    std::size_t batch = 256;
+    std::size_t threshold = 4096;
+    int procs = 1;
+    std::size_t shard_threshold = 1 << 20;
+};
+
+struct Request {
+    std::string text;
+    Clock::time_point arrival;
+    Node::Ptr root;
+    std::vector<Node::Ptr> nodes;
+    double value = 0.0;
+    std::string error;
+};
+
+// Buffered line reader over a raw fd, able to tell whether another line is
+// available without blocking (used to close a batch early).
+class LineReader {
+    int fd;
+    std::string buf;
+    bool eof{false};
+
+    bool fill(int timeout_ms) {
+        if (eof) return false;
+        pollfd p{fd, POLLIN, 0};
+        if (poll(&p, 1, timeout_ms) <= 0) return false;
+        char chunk[1 << 16];
+        ssize_t r = read(fd, chunk, sizeof(chunk));
+        if (r <= 0) { eof = true; return false; }
+        buf.append(chunk, static_cast<std::size_t>(r));
+        return true;
+    }
+
+public:
+    explicit LineReader(int f) : fd(f) {}
+
+    // block == false: only return a line that is already readable
+    bool next(std::string& line, bool block) {
+        while (true) {
+            auto nl = buf.find('\n');
+            if (nl != std::string::npos) {
+                line.assign(buf, 0, nl);
+                buf.erase(0, nl + 1);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                return true;
+            }
+            if (!fill(block ? -1 : 0)) {
+                if (!eof || buf.empty()) return false;
+                line.swap(buf); // last line without trailing newline
+                buf.clear();
+                return true;
+            }
+        }
+    }
+};
+
+class Stats {
+    std::vector<double> latencies_us;
+    Clock::time_point start = Clock::now();
+
+    double percentile(double p) {
+        if (latencies_us.empty()) return 0.0;
+        std::size_t k = static_cast<std::size_t>(p * (latencies_us.size() - 1));
+        std::nth_element(latencies_us.begin(), latencies_us.begin() + k, latencies_us.end());
+        return latencies_us[k];
+    }
+
+public:
+    std::size_t errors = 0;
+
+    void record(const Request& r, Clock::time_point done) {
+        latencies_us.push_back(std::chrono::duration<double, std::micro>(done - r.arrival).count());
+        if (!r.error.empty()) ++errors;
+    }
+
+    void report(std::ostream& os, const std::string& source) {
+        double secs = std::chrono::duration<double>(Clock::now() - start).count();
+        std::size_t n = latencies_us.size();
+        os << std::fixed << std::setprecision(3)
+           << "[eval] " << source << ": " << n << " requests, " << errors << " errors, "
+           << (secs > 0 ? n / secs : 0.0) << " req/s, p50 " << percentile(0.50)
+           << " us, p99 " << percentile(0.99) << " us\n";
+    }
+};
+
+class EvalService {
+    Options opt;
+    SimplePool pool;
+
+    // Right operands of the DivideNodes, taken while the tree is still linked.
+    static std::vector<const Node*> divisors(const std::vector<Node::Ptr>& nodes)
+    {
+        std::vector<const Node*> divs;
+        for (const Node::Ptr& v : nodes)
+            if (v->op() == '/') divs.push_back(v->children()[1].get());
+        return divs;
+    }
+
+    // Once every node holds its value (compute(), or contraction + expansion).
+    static bool dividesByZero(const std::vector<const Node*>& divs)
+    {
+        for (const Node* v : divs)
+            if (*v->value == 0) return true;
+        return false;
+    }
+
+    // Frees the tree parents first. The parser collects nodes children first
+    // (root swapped to the front), so popping them in reverse never frees a
+    // node that still owns a subtree; dropping the root alone would free a
+    // long chain recursively and overflow the stack.
+    static void release(Request& r)
+    {
+        if (r.root && !r.nodes.empty()) std::swap(r.nodes.front(), r.nodes.back());
+        r.root.reset();
+        while (!r.nodes.empty()) r.nodes.pop_back();
+    }
+
+    static void schedule_parse(std::vector<Request>& batch, std::size_t st, std::size_t en,
+                               std::size_t threshold, std::latch& ltch)
+    {
+        for (std::size_t i = st; i < en; ++i) {
+            Request& r = batch[i];
+            try {
+                r.root = ExpressionParser::parse(r.text, r.nodes);
+                if (r.nodes.size() < threshold) {
+                    r.value = r.root->compute();
+                    if (dividesByZero(divisors(r.nodes))) r.error = "division by zero";
+                    release(r);
+                }
+            } catch (const std::exception& e) {
+                r.error = e.what();
+                release(r);
+            }
+            ltch.count_down();
+        }
+    }
+
+    void evaluate(std::vector<Request>& batch)
+    {
+        TRACE_SCOPE("batch", static_cast<int64_t>(batch.size()));
+        int n = static_cast<int>(batch.size());
+        int stride = n / static_cast<int>(opt.threads) + 1;
+        std::latch ltch(n);
+        for (int i = 0; i < n; i += stride)
+            pool.push(schedule_parse,
+                      std::ref(batch),
+                      static_cast<std::size_t>(i),
+                      static_cast<std::size_t>(std::min(i + stride, n)),
+                      opt.threshold,
+                      std::ref(ltch));
+        ltch.wait();
+        pool.waitIdle();
+
+        // large expressions: one contraction at a time, each using the whole pool
+        for (Request& r : batch) {
+            if (!r.root) continue;
+            if (opt.procs > 1 && r.nodes.size() >= opt.shard_threshold) {
+                try {
+                    r.value = ShardedEvaluation::Evaluate(r.root, opt.procs, static_cast<int>(opt.threads), pool);
+                } catch (const std::exception& e) {
+                    r.error = e.what();
+                }
+                release(r);
+                continue;
+            }
+            std::vector<const Node*> divs = divisors(r.nodes);
+            int rounds = TreeContraction::TreeContract(r.nodes, r.root, static_cast<int>(opt.threads), pool);
+            pool.waitIdle();
+            r.value = r.root->value ? *r.root->value : r.root->compute();
+            if (!divs.empty()) {
+                // a zero divisor can be composed away inside a map, so look at the divisors themselves
+                TreeContraction::TreeExpand(r.nodes, rounds, static_cast<int>(opt.threads), pool);
+                pool.waitIdle();
+                if (dividesByZero(divs)) r.error = "division by zero";
+            }
+            release(r);
+        }
+    }
+
+    static bool write_all(int fd, const std::string& s)
+    {
+        std::size_t off = 0;
+        while (off < s.size()) {
+            ssize_t w = write(fd, s.data() + off, s.size() - off);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            off += static_cast<std::size_t>(w);
+        }
+        return true;
+    }
+
+public:
+    explicit EvalService(const Options& o) : opt(o), pool(o.threads) {}
+
+    // Serves one stream until EOF; results go to out_fd in request order.
+    void serve(int in_fd, int out_fd, const std::string& source)
+    {
+        LineReader reader(in_fd);
+        Stats stats;
+        std::vector<Request> batch;
+        std::string line;
+        while (reader.next(line, true)) {
+            batch.clear();
+            do {
+                // blank lines too get their answer, so replies stay aligned with requests
+                batch.push_back({std::move(line), Clock::now(), nullptr, {}, 0.0, {}});
+            } while (batch.size() < opt.batch && reader.next(line, false));
+
+            evaluate(batch);
+
+            std::ostringstream os;
+            os << std::setprecision(17);
+            for (const Request& r : batch) {
+                if (r.error.empty()) os << r.value << '\n';
+                else os << "error: " << r.error << '\n';
+            }
+            bool ok = write_all(out_fd, os.str());
+            auto done = Clock::now();
+            for (const Request& r : batch) stats.record(r, done);
+            if (!ok) break;
+        }
+        stats.report(std::cerr, source);
+    }
+
+    int serve_socket(const std::string& path)
+    {
+        int srv = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (srv < 0) { std::cerr << "socket: " << std::strerror(errno) << '\n'; return 1; }
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) { std::cerr << "socket path too long\n"; return 1; }
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(path.c_str());
+        if (bind(srv, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(srv, 16) < 0) {
+            std::cerr << "bind/listen " << path << ": " << std::strerror(errno) << '\n';
+            close(srv);
+            return 1;
+        }
+        std::cerr << "[eval] listening on " << path << '\n';
+        while (true) {
+            int conn = accept(srv, nullptr, nullptr);
+            if (conn < 0) {
+                if (errno == EINTR) continue;
+                std::cerr << "accept: " << std::strerror(errno) << '\n';
+                break;
+            }
+            serve(conn, conn, path);
+            close(conn);
+            TRACE_DUMP();
+        }
+        close(srv);
+        return 1;
+    }
+};
+
+static void usage() {
+    std::cerr << "usage: eval [--input FILE | --socket PATH] [--threads N] [--batch N] [--threshold N]\n"
+                 "            [--procs N] [--shard-threshold N]\n";
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if (i + 1 >= argc) { usage(); return 2; }
+        std::string v = argv[++i];
+        try {
+            if (a == "--input") opt.input = v;
+            else if (a == "--socket") opt.socket_path = v;
+            else if (a == "--threads") opt.threads = std::max(1, std::stoi(v));
+            else if (a == "--batch") opt.batch = std::max(1, std::stoi(v));
+            else if (a == "--threshold") opt.threshold = std::stoul(v);
+            else if (a == "--procs") opt.procs = std::max(1, std::stoi(v));
+            else if (a == "--shard-threshold") opt.shard_threshold = std::stoul(v);
+            else { usage(); return 2; }
+        } catch (const std::exception&) { // std::invalid_argument / std::out_of_range
+            std::cerr << a << ": bad value '" << v << "'\n";
+            usage();
+            return 2;
+        }
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+
+    EvalService service(opt);
+    if (!opt.socket_path.empty())
+        return service.serve_socket(opt.socket_path);
 
-int main() {
+    int in_fd = STDIN_FILENO;
+    if (!opt.input.empty()) {
+        in_fd = open(opt.input.c_str(), O_RDONLY);
+        if (in_fd < 0) {
+            std::cerr << opt.input << ": " << std::strerror(errno) << '\n';
+            return 1;
+        }
+    }
+    service.serve(in_fd, STDOUT_FILENO, opt.input.empty() ? "stdin" : opt.input);
+    if (in_fd != STDIN_FILENO) close(in_fd);
+    TRACE_DUMP();
     return 0;
 }